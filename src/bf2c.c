@@ -22,7 +22,7 @@
  * SOFTWARE.
  */
 
-#include <stdio.h>          // putchar, getchar, vprintf, fprintf, fopen, fgetc, fclose
+#include <stdio.h>          // putchar, getchar, vprintf, fprintf, fopen, fgetc, fclose, ftell, fseek
 #include <stdlib.h>         // exit
 #include <errno.h>          // strerror, errno
 #include <unistd.h>         // isatty
@@ -37,6 +37,7 @@
 #define DATA_SIZE 65535
 
 int getop(void);
+int match(const char*);
 void bf2c(void);
 void depth_printf(int, const char*, ...);
 
@@ -63,13 +64,30 @@ int getop()
     }
 }
 
+/*
+ * Consume the ops in pattern if they come next in the source, otherwise
+ * leave the read position untouched.
+ */
+int match(const char *pattern)
+{
+    long at = ftell(fp);
+    while(*pattern && getop() == *pattern)
+        pattern++;
+    if(!*pattern)
+        return 1;
+    fseek(fp, at, SEEK_SET);
+    return 0;
+}
+
 void bf2c()
 {
-    printf("#include <stdio.h>\n\n"
+    printf("#include <stdio.h>\n"
+        "#include <string.h>\n\n"
         "extern int bf_getchar();\n"
         "extern int bf_putchar(int);\n\n"
         "char data[%d] = {};\n"
-        "int pos = 0;\n\n"
+        "int pos = 0;\n"
+        "size_t count = 0;\n\n"
         "int main()\n"
         "{\n", DATA_SIZE);
 
@@ -148,6 +166,67 @@ void bf2c()
                 }
                 break;
             case '[':
+                if(match("-]") || match("+]"))
+                {
+                    while(match(">[-]"))
+                        count++;
+                    if(count == 1)
+                        depth_printf(depth, "data[pos] = 0;\n");
+                    else
+                    {
+                        depth_printf(depth, "memset(&data[pos], 0, %d);\n", count);
+                        depth_printf(depth, "pos += %d;\n", count - 1);
+                    }
+                    break;
+                }
+                if(match(">]"))
+                {
+                    depth_printf(depth, "pos += strnlen(&data[pos], sizeof(data) - pos);\n");
+                    break;
+                }
+                if(match("[-]>]"))
+                {
+                    depth_printf(depth, "count = strnlen(&data[pos], sizeof(data) - pos);\n");
+                    depth_printf(depth, "memset(&data[pos], 0, count);\n");
+                    depth_printf(depth, "pos += count;\n");
+                    break;
+                }
+                if(match("[-<+>]>]"))
+                {
+                    depth_printf(depth, "if((count = strnlen(&data[pos], sizeof(data) - pos)))\n");
+                    depth_printf(depth, "{\n");
+                    depth_printf(depth + 1, "data[pos - 1] += data[pos];\n");
+                    depth_printf(depth + 1, "memmove(&data[pos], &data[pos + 1], count - 1);\n");
+                    depth_printf(depth + 1, "data[pos + count - 1] = 0;\n");
+                    depth_printf(depth + 1, "pos += count;\n");
+                    depth_printf(depth, "}\n");
+                    break;
+                }
+                if(match("<]"))
+                {
+                    depth_printf(depth, "while(data[pos])\n");
+                    depth_printf(depth + 1, "pos--;\n");
+                    break;
+                }
+                if(match("[-]<]"))
+                {
+                    depth_printf(depth, "for(count = 0; data[pos - count]; count++);\n");
+                    depth_printf(depth, "pos -= count;\n");
+                    depth_printf(depth, "memset(&data[pos + 1], 0, count);\n");
+                    break;
+                }
+                if(match("[->+<]<]"))
+                {
+                    depth_printf(depth, "for(count = 0; data[pos - count]; count++);\n");
+                    depth_printf(depth, "if(count)\n");
+                    depth_printf(depth, "{\n");
+                    depth_printf(depth + 1, "data[pos + 1] += data[pos];\n");
+                    depth_printf(depth + 1, "pos -= count;\n");
+                    depth_printf(depth + 1, "memmove(&data[pos + 2], &data[pos + 1], count - 1);\n");
+                    depth_printf(depth + 1, "data[pos + 1] = 0;\n");
+                    depth_printf(depth, "}\n");
+                    break;
+                }
                 depth_printf(depth, "while(data[pos])\n");
                 depth_printf(depth, "{\n");
                 depth++;
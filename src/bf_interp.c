@@ -24,8 +24,14 @@
 
 #include <stdio.h>          // putchar, getchar, fprintf, fopen, fgetc, fclose, rewind
 #include <stdlib.h>         // exit
+#include <string.h>         // memset, memmove, memchr
 #include <errno.h>          // strerror, errno
-#include <unistd.h>         // isatty
+#include <unistd.h>         // isatty, read, write
+#include <time.h>           // clock_gettime
+#include <signal.h>         // signal, SIGUSR1
+#include <fcntl.h>          // open
+#include <sys/mman.h>       // mmap, munmap
+#include <sys/stat.h>       // fstat
 
 #define ABOUT \
     "BFINTERP v3.8 built on " __DATE__ " " __TIME__ ".\n" \
@@ -35,17 +41,19 @@
 
 #define DATA_SIZE 65535
 #define PROG_SIZE 1024*1024
-
-int load_bf();
-int exec_bf();
-
-int sp = 0;
-int bf_size = 0;
-FILE *fp = NULL;
-char data[DATA_SIZE] = {};
-int prog[PROG_SIZE] = {};
-int stack[PROG_SIZE/2] = {};
-int (*bf_func[])() = { load_bf, exec_bf };
+#define LOOP_MAX_CELLS 8
+#define PROF_MAGIC "bfprof"
+#define PROF_HOT_SHARE 16
+#define STEP_BATCH 65536
+#define LIMIT_STATUS 124
+#define FUNC_DONE -100
+#define SNAP_MAGIC "BFSNAP2"
+#define BFC_MAGIC "\177BFC"
+#define BFC_VERSION 3
+#define KNOWN_SIZE 64
+#define KNOWN_DEPTH 64
+#define IO_BUF_SIZE 65536
+#define OUT_FLUSH_SIZE 4096
 
 enum
 {
@@ -59,9 +67,167 @@ enum
     OP_VAL_DEC,
     OP_POS_ADD,
     OP_POS_INC,
-    OP_POS_DEC
+    OP_POS_DEC,
+    OP_MUL_LOOP,
+    OP_POLY_LOOP,
+    OP_MEM_CLR,
+    OP_CLR_RUN,
+    OP_SCAN,
+    OP_SHIFT,
+    OP_MOVE_ADD,
+    OP_ADD_MOVE,
+    OP_VAL_SET,
+    OP_IO_MAP,
+    OP_MAX
+};
+
+/* bf_run() results */
+enum
+{
+    BF_DONE = 0,
+    BF_NEED_INPUT,
+    BF_OUTPUT,
+    BF_SNAPSHOT,
+    BF_LIMIT,
+    BF_BAD_OP
+};
+
+int prof_load();
+int load_bf();
+int bfc_load();
+int bfc_save();
+int snap_resume();
+int exec_bf();
+int prof_save();
+
+struct loop_prof
+{
+    unsigned long long entries;
+    unsigned long long skips;
+    unsigned long long iters;
+    int kept;
+};
+
+/*
+ * A snapshot file is this header followed by the non-zero runs of the
+ * tape, each stored as { offset, length } and then its bytes.
+ */
+struct snap_header
+{
+    char magic[8];
+    unsigned int prog_hash;
+    unsigned int code_hash;
+    unsigned int pc;
+    unsigned int pos;
+    unsigned int runs;
+    unsigned long long steps_used;
+    unsigned long long snap_next;
 };
 
+/*
+ * Cell values known at compile time, for the KNOWN_SIZE cells around the
+ * pointer. Cell off lives in slot (cur + off) % KNOWN_SIZE; everything
+ * outside the window is zero while rest_zero is set.
+ */
+struct known_cells
+{
+    int cur;
+    int rest_zero;
+    unsigned char known[KNOWN_SIZE];
+    unsigned char val[KNOWN_SIZE];
+};
+
+/*
+ * One run of the program. bf_run() returns BF_NEED_INPUT once in[] is
+ * used up (set eof to read zeroes from then on instead) and BF_OUTPUT
+ * when out[] is full, or after a newline when line_flush is set; the
+ * caller refills or drains them and calls again. BF_SNAPSHOT means a
+ * snapshot is due: drain out[] first, then snap_save() the context.
+ * The context names the compiled program it runs (prog_size words before
+ * its OP_STOP, prog_hash of its source) and, when profiling, its loop_map. A zero budget is
+ * refilled through step_batch() on entry. Limits and snapshots are per
+ * run: zero max_steps, deadline or snap_steps means none, and snap_flag
+ * (if set) points at a flag raised to request a snapshot.
+ */
+struct bf_ctx
+{
+    const int *prog;
+    int prog_size;
+    unsigned int prog_hash;
+    int *loop_map;
+    int pc;
+    unsigned int pos;
+    char *data;
+    unsigned int budget;
+    const unsigned char *in;
+    size_t in_len;
+    int eof;
+    unsigned char *out;
+    size_t out_len;
+    size_t out_size;
+    int line_flush;
+    int prof_last;
+    unsigned long long max_steps;
+    unsigned long long steps_used;
+    double deadline;
+    const char *snap_file;
+    unsigned long long snap_steps;
+    unsigned long long snap_next;
+    volatile sig_atomic_t *snap_flag;
+};
+
+/*
+ * A compiled (.bfc) file is this header followed by prog[] up to and
+ * including its OP_STOP. Jumps are stored as indices into prog[], so the
+ * code can be run straight from a read-only mapping.
+ */
+struct bfc_header
+{
+    char magic[4];
+    unsigned int version;
+    unsigned int prog_hash;
+    unsigned int nloops;
+    unsigned int size;
+    unsigned int checksum;
+};
+
+int sp = 0;
+int bf_size = 0;
+int clr_op = -1;
+int nloops = 0;
+unsigned int prog_hash = 2166136261u;
+FILE *fp = NULL;
+const char *prof_in = NULL;
+const char *prof_out = NULL;
+const char *opt_max_steps = NULL;
+const char *opt_timeout = NULL;
+unsigned long long max_steps = 0;
+double deadline = 0;
+const char *snap_file = NULL;
+const char *snap_in = NULL;
+const char *opt_snap_steps = NULL;
+unsigned long long snap_steps = 0;
+unsigned long long snap_next = 0;
+volatile sig_atomic_t snap_signal = 0;
+int start_pc = 0;
+unsigned int start_pos = 0;
+unsigned long long start_steps = 0;
+char data[DATA_SIZE] = {};
+int prog_buf[PROG_SIZE] = {};
+int *prog = prog_buf;
+struct known_cells kc = {};
+struct known_cells kc_saved[KNOWN_DEPTH] = {};
+const char *bfc_src = NULL;
+const char *bfc_out = NULL;
+int stack[PROG_SIZE/2] = {};
+int *loop_map = NULL;
+int prof_nloops = 0;
+unsigned int prof_hash = 0;
+struct loop_prof *loops = NULL;
+unsigned long long pairs[OP_MAX][OP_MAX] = {};
+int (*bf_func[])() = { prof_load, load_bf, bfc_save, snap_resume, exec_bf, prof_save };
+
+
 void op_emitter(unsigned int op)
 {
     if(bf_size >= PROG_SIZE)
@@ -91,18 +257,812 @@ int getop()
             case ',':
             case '[':
             case ']':
+                prog_hash = (prog_hash ^ c) * 16777619u;
+                return c;
             case EOF:
                 return c;
         }
     }
 }
 
+int op_len(const int *op)
+{
+    switch(op[0])
+    {
+        case OP_JMP_FWD:
+        case OP_JMP_BACK:
+        case OP_VAL_ADD:
+        case OP_POS_ADD:
+        case OP_MEM_CLR:
+        case OP_CLR_RUN:
+        case OP_SCAN:
+        case OP_SHIFT:
+        case OP_VAL_SET:
+        case OP_IO_MAP:
+            return 2;
+        case OP_MOVE_ADD:
+        case OP_ADD_MOVE:
+            return 3;
+        case OP_MUL_LOOP:
+            return 2 + 2 * op[1];
+        case OP_POLY_LOOP:
+            return op[1];
+        default:
+            return 1;
+    }
+}
+
+/*
+ * Multiplicative inverse of an odd number modulo 256.
+ */
+int inv256(int d)
+{
+    int x = d;
+    for(int i = 0; i < 3; i++)
+        x = (x * (2 - d * x)) & 0xff;
+    return x;
+}
+
+void mat_mul(int n, int (*r)[LOOP_MAX_CELLS + 1],
+        int (*a)[LOOP_MAX_CELLS + 1], int (*b)[LOOP_MAX_CELLS + 1])
+{
+    for(int i = 0; i < n; i++)
+    {
+        for(int j = 0; j < n; j++)
+        {
+            int s = 0;
+            for(int k = 0; k < n; k++)
+                s += a[i][k] * b[k][j];
+            r[i][j] = s & 0xff;
+        }
+    }
+}
+
+/*
+ * Emit a single cell clear at prog[start], widening the previous OP_MEM_CLR
+ * instead when only `k` steps to the right separate the two, so that
+ * `[-]>[-]>[-]` ends up as one memset.
+ */
+void mem_clr(int start)
+{
+    if(clr_op >= 0 && clr_op < start)
+    {
+        int pos = 0;
+        int i = clr_op + 2;
+        for(; i < start; i += op_len(&prog[i]))
+        {
+            if(prog[i] == OP_POS_INC)
+                pos++;
+            else if(prog[i] == OP_POS_ADD)
+                pos += prog[i + 1];
+            else
+                break;
+        }
+        if(i == start && pos == prog[clr_op + 1])
+        {
+            prog[clr_op + 1]++;
+            bf_size = clr_op + 2;
+            if(pos == 1)
+                op_emitter(OP_POS_INC);
+            else
+            {
+                op_emitter(OP_POS_ADD);
+                op_emitter(pos);
+            }
+            return;
+        }
+    }
+
+    bf_size = start;
+    clr_op = start;
+    op_emitter(OP_MEM_CLR);
+    op_emitter(1);
+}
+
+/*
+ * Bulk memory idioms over zero-terminated runs of cells:
+ *
+ *     [>] [<] [>>>]    OP_SCAN   step
+ *     [[-]>] [[-]<]    OP_CLR_RUN dir
+ *     [[-<+>]>]        OP_SHIFT  1  (shift the run one cell left)
+ *     [[->+<]<]        OP_SHIFT -1  (shift the run one cell right)
+ *
+ * Returns the op the loop became, or 0.
+ */
+int loop_idiom(int start)
+{
+    int *body = &prog[start + 2];
+    int len = bf_size - start - 2;
+    int op = OP_STOP;
+    int arg = 0;
+
+    if(len == 1 && (body[0] == OP_POS_INC || body[0] == OP_POS_DEC))
+    {
+        op = OP_SCAN;
+        arg = ((body[0] == OP_POS_INC) ? 1 : -1);
+    }
+    else if(len == 2 && body[0] == OP_POS_ADD)
+    {
+        op = OP_SCAN;
+        arg = body[1];
+    }
+    else if(len == 3 && body[0] == OP_MEM_CLR && body[1] == 1
+            && (body[2] == OP_POS_INC || body[2] == OP_POS_DEC))
+    {
+        op = OP_CLR_RUN;
+        arg = ((body[2] == OP_POS_INC) ? 1 : -1);
+    }
+    else if(len == 5 && body[0] == OP_MUL_LOOP && body[1] == 1 && body[3] == 1
+            && ((body[2] == -1 && body[4] == OP_POS_INC)
+                || (body[2] == 1 && body[4] == OP_POS_DEC)))
+    {
+        op = OP_SHIFT;
+        arg = -body[2];
+    }
+    if(op == OP_STOP)
+        return 0;
+
+    if(clr_op >= start)
+        clr_op = -1;
+    bf_size = start;
+    op_emitter(op);
+    op_emitter(arg);
+    return op;
+}
+
+/*
+ * Try to replace the loop whose OP_JMP_FWD sits at prog[start] with a
+ * closed form, returning the op it became. The body must have zero net
+ * pointer movement, no I/O and no nested loops other than ones already
+ * lowered to OP_MUL_LOOP or OP_MEM_CLR, and the control cell may only
+ * change by an odd constant per iteration, so the trip count is known on
+ * entry.
+ *
+ * One iteration is then an affine map M over the touched cells (plus a
+ * constant 1). A flat body only adds constants and becomes OP_MUL_LOOP.
+ * With nested loops or stores we require M(M-I)^3 = 0 mod 256, so the third
+ * difference of M^k vanishes for k >= 1 and
+ *
+ *     M^n = M + (n-1)(M^2-M) + C(n-1,2)(M^3-2M^2+M)
+ *
+ * which OP_POLY_LOOP evaluates in one step (products and triangular sums).
+ */
+int loop_lower(int start)
+{
+    int off[LOOP_MAX_CELLS] = { 0 };
+    int cells = 1;
+    int nested = 0;
+    int pos = 0;
+
+    for(int i = start + 2; i < bf_size; i += op_len(&prog[i]))
+    {
+        int touch[LOOP_MAX_CELLS + 1];
+        int n = 0;
+        switch(prog[i])
+        {
+            case OP_VAL_SET:
+                nested = 1;
+                /* fall through */
+            case OP_VAL_ADD:
+            case OP_VAL_INC:
+            case OP_VAL_DEC:
+                touch[n++] = pos;
+                break;
+            case OP_POS_ADD:
+                pos += prog[i + 1];
+                break;
+            case OP_POS_INC:
+                pos++;
+                break;
+            case OP_POS_DEC:
+                pos--;
+                break;
+            case OP_MUL_LOOP:
+                if(prog[i + 1] >= LOOP_MAX_CELLS)
+                    return 0;
+                nested = 1;
+                touch[n++] = pos;
+                for(int j = 0; j < prog[i + 1]; j++)
+                    touch[n++] = pos + prog[i + 2 + 2 * j];
+                break;
+            case OP_MEM_CLR:
+                if(prog[i + 1] > LOOP_MAX_CELLS)
+                    return 0;
+                nested = 1;
+                for(int j = 0; j < prog[i + 1]; j++)
+                    touch[n++] = pos + j;
+                break;
+            default:
+                return 0;
+        }
+        for(int j = 0; j < n; j++)
+        {
+            int k = 0;
+            while(k < cells && off[k] != touch[j])
+                k++;
+            if(k == cells)
+            {
+                if(cells >= LOOP_MAX_CELLS)
+                    return 0;
+                off[cells++] = touch[j];
+            }
+        }
+    }
+    if(pos)
+        return 0;
+
+    /* Row r of m is the new value of cell off[r]; column `cells` is the constant. */
+    int m[LOOP_MAX_CELLS + 1][LOOP_MAX_CELLS + 1] = {};
+    for(int r = 0; r <= cells; r++)
+        m[r][r] = 1;
+
+    for(int i = start + 2; i < bf_size; i += op_len(&prog[i]))
+    {
+        int r = 0;
+        switch(prog[i])
+        {
+            case OP_POS_ADD:
+                pos += prog[i + 1];
+                continue;
+            case OP_POS_INC:
+                pos++;
+                continue;
+            case OP_POS_DEC:
+                pos--;
+                continue;
+        }
+        while(off[r] != pos)
+            r++;
+        switch(prog[i])
+        {
+            case OP_VAL_ADD:
+                m[r][cells] += prog[i + 1];
+                break;
+            case OP_VAL_INC:
+                m[r][cells]++;
+                break;
+            case OP_VAL_DEC:
+                m[r][cells]--;
+                break;
+            case OP_VAL_SET:
+                for(int c = 0; c < cells; c++)
+                    m[r][c] = 0;
+                m[r][cells] = prog[i + 1];
+                break;
+            case OP_MUL_LOOP:
+                for(int j = 0; j < prog[i + 1]; j++)
+                {
+                    int t = 0;
+                    while(off[t] != pos + prog[i + 2 + 2 * j])
+                        t++;
+                    for(int c = 0; c <= cells; c++)
+                        m[t][c] += prog[i + 3 + 2 * j] * m[r][c];
+                }
+                for(int c = 0; c <= cells; c++)
+                    m[r][c] = 0;
+                break;
+            case OP_MEM_CLR:
+                for(int j = 0; j < prog[i + 1]; j++)
+                {
+                    int t = 0;
+                    while(off[t] != pos + j)
+                        t++;
+                    for(int c = 0; c <= cells; c++)
+                        m[t][c] = 0;
+                }
+                break;
+        }
+        for(int t = 0; t < cells; t++)
+            for(int c = 0; c <= cells; c++)
+                m[t][c] &= 0xff;
+    }
+
+    /* The control cell must only step by an odd constant. */
+    for(int c = 1; c < cells; c++)
+        if(m[0][c])
+            return 0;
+    if(m[0][0] != 1 || !(m[0][cells] & 1))
+        return 0;
+    int mult = (-inv256(m[0][cells])) & 0xff;
+
+    if(!nested && cells == 1)
+    {
+        mem_clr(start);
+        return OP_MEM_CLR;
+    }
+    if(!nested)
+    {
+        bf_size = start;
+        op_emitter(OP_MUL_LOOP);
+        op_emitter(0);
+        for(int r = 1; r < cells; r++)
+        {
+            if(m[r][cells])
+            {
+                op_emitter(off[r]);
+                op_emitter((m[r][cells] * mult) & 0xff);
+                prog[start + 1]++;
+            }
+        }
+        return OP_MUL_LOOP;
+    }
+
+    int n = cells + 1;
+    int m2[LOOP_MAX_CELLS + 1][LOOP_MAX_CELLS + 1];
+    int m3[LOOP_MAX_CELLS + 1][LOOP_MAX_CELLS + 1];
+    int m4[LOOP_MAX_CELLS + 1][LOOP_MAX_CELLS + 1];
+    mat_mul(n, m2, m, m);
+    mat_mul(n, m3, m2, m);
+    mat_mul(n, m4, m3, m);
+    for(int r = 0; r < n; r++)
+        for(int c = 0; c < n; c++)
+            if((m4[r][c] - 3 * m3[r][c] + 3 * m2[r][c] - m[r][c]) & 0xff)
+                return 0;
+
+    if(clr_op >= start)
+        clr_op = -1;
+    bf_size = start;
+    op_emitter(OP_POLY_LOOP);
+    op_emitter(4 + cells + 3 * cells * n);
+    op_emitter(cells);
+    op_emitter(mult);
+    for(int r = 0; r < cells; r++)
+        op_emitter(off[r]);
+    for(int r = 0; r < cells; r++)
+        for(int c = 0; c < n; c++)
+            op_emitter(m[r][c]);
+    for(int r = 0; r < cells; r++)
+        for(int c = 0; c < n; c++)
+            op_emitter((m2[r][c] - m[r][c]) & 0xff);
+    for(int r = 0; r < cells; r++)
+        for(int c = 0; c < n; c++)
+            op_emitter((m3[r][c] - 2 * m2[r][c] + m[r][c]) & 0xff);
+    return OP_POLY_LOOP;
+}
+
+/*
+ * A loop the profile saw kept as a jump pair whose body never ran is not
+ * worth the closed-form and idiom analyses.
+ */
+int loop_cold(int id)
+{
+    return (loops && id < prof_nloops
+            && loops[id].kept && loops[id].entries == loops[id].skips);
+}
+
+/*
+ * Net effect of a pointer or cell arithmetic op.
+ */
+int op_count(const int *op)
+{
+    switch(op[0])
+    {
+        case OP_VAL_ADD:
+        case OP_POS_ADD:
+            return op[1];
+        case OP_VAL_INC:
+        case OP_POS_INC:
+            return 1;
+        case OP_VAL_DEC:
+        case OP_POS_DEC:
+            return -1;
+        default:
+            return 0;
+    }
+}
+
+int is_pos_op(int op)
+{
+    return (op == OP_POS_ADD || op == OP_POS_INC || op == OP_POS_DEC);
+}
+
+int is_val_op(int op)
+{
+    return (op == OP_VAL_ADD || op == OP_VAL_INC || op == OP_VAL_DEC);
+}
+
+/*
+ * Copy-through and map-through I/O loops, [.,] [+++.,] [-.,], which echo
+ * each input byte plus a constant until a zero byte or EOF is read. The
+ * loop is kept, but its body becomes
+ *
+ *     OP_IO_MAP add  OP_PUTCHAR  OP_GETCHAR
+ *
+ * where OP_IO_MAP runs as many iterations in bulk as the buffers allow
+ * and leaves the rest, and any yield, to the single-byte ops after it.
+ */
+void io_loop(int start)
+{
+    int *body = &prog[start + 2];
+    int len = bf_size - start - 2;
+    int n = (len > 2 ? op_len(body) : 0);
+    if(len != n + 2 || (n && !is_val_op(body[0]))
+        || body[n] != OP_PUTCHAR || body[n + 1] != OP_GETCHAR)
+        return;
+
+    int add = (n ? op_count(body) : 0);
+    bf_size = start + 2;
+    op_emitter(OP_IO_MAP);
+    op_emitter(add);
+    op_emitter(OP_PUTCHAR);
+    op_emitter(OP_GETCHAR);
+}
+
+/*
+ * Fuse the pointer move / cell add pairs that the profile shows are hot
+ * into OP_MOVE_ADD and OP_ADD_MOVE superinstructions, relocating jumps.
+ */
+int prof_fuse()
+{
+    unsigned long long total = 0;
+    unsigned long long move_add = 0;
+    unsigned long long add_move = 0;
+    for(int a = 0; a < OP_MAX; a++)
+    {
+        for(int b = 0; b < OP_MAX; b++)
+        {
+            total += pairs[a][b];
+            if(is_pos_op(a) && is_val_op(b))
+                move_add += pairs[a][b];
+            else if(is_val_op(a) && is_pos_op(b))
+                add_move += pairs[a][b];
+        }
+    }
+    int fuse_move_add = (move_add && move_add * PROF_HOT_SHARE >= total);
+    int fuse_add_move = (add_move && add_move * PROF_HOT_SHARE >= total);
+    if(!fuse_move_add && !fuse_add_move)
+        return 0;
+
+    /* Fusing two one-word ops takes three words, so the code may grow. */
+    int *map = malloc((bf_size + 1) * sizeof(*map));
+    int *out = malloc((bf_size * 3 / 2 + 1) * sizeof(*out));
+    int *ids = (loop_map ? calloc(PROG_SIZE, sizeof(*ids)) : NULL);
+    if(map == NULL || out == NULL || (loop_map && ids == NULL))
+    {
+        free(map);
+        free(out);
+        free(ids);
+        return -1;
+    }
+
+    int n = 0;
+    for(int i = 0; i < bf_size; i += op_len(&prog[i]))
+    {
+        int j = i + op_len(&prog[i]);
+        map[i] = n;
+        if(j < bf_size
+            && ((fuse_move_add && is_pos_op(prog[i]) && is_val_op(prog[j]))
+                || (fuse_add_move && is_val_op(prog[i]) && is_pos_op(prog[j]))))
+        {
+            out[n++] = (is_pos_op(prog[i]) ? OP_MOVE_ADD : OP_ADD_MOVE);
+            out[n++] = op_count(&prog[i]);
+            out[n++] = op_count(&prog[j]);
+            i = j;
+            continue;
+        }
+        if(ids && prog[i] == OP_JMP_FWD)
+            ids[n] = loop_map[i];
+        for(int k = 0; k < j - i; k++)
+            out[n + k] = prog[i + k];
+        if(prog[i] == OP_JMP_BACK)
+            out[n + 1] = map[i + prog[i + 1]] + 1 - (n + 1);
+        n += j - i;
+    }
+    map[bf_size] = n;
+    for(int i = 0; i < n; i += op_len(&out[i]))
+        if(out[i] == OP_JMP_FWD)
+            out[i + 1] = map[out[i + 1] - 1] + 1;
+
+    if(n < PROG_SIZE)
+    {
+        for(int i = 0; i < n; i++)
+            prog[i] = out[i];
+        bf_size = n;
+        prog[bf_size] = OP_STOP;
+        clr_op = -1;
+        if(ids)
+        {
+            free(loop_map);
+            loop_map = ids;
+            ids = NULL;
+        }
+    }
+    free(map);
+    free(out);
+    free(ids);
+    return 0;
+}
+
+void prof_count(struct bf_ctx *ctx, int i, unsigned int pos)
+{
+    const int *prog = ctx->prog;
+    const int *loop_map = ctx->loop_map;
+    const char *data = ctx->data;
+    pairs[ctx->prof_last][prog[i]]++;
+    ctx->prof_last = prog[i];
+
+    if(prog[i] == OP_JMP_FWD)
+    {
+        struct loop_prof *l = &loops[loop_map[i]];
+        l->entries++;
+        if(!data[pos])
+            l->skips++;
+    }
+    else if(prog[i] == OP_JMP_BACK && data[pos])
+    {
+        loops[loop_map[i + prog[i + 1]]].iters++;
+    }
+}
+
+/*
+ * Check the profile's hash and loop count against the source before
+ * load_bf() parses it, so a profile of another program never changes the
+ * code. A source that can't be rewound (a pipe) is spooled to a
+ * temporary file first.
+ */
+int prof_match()
+{
+    long at = ftell(fp);
+    int c;
+    if(at < 0)
+    {
+        FILE *tmp = tmpfile();
+        if(tmp == NULL)
+            return 0;
+        while((c = fgetc(fp)) != EOF)
+            fputc(c, tmp);
+        rewind(tmp);
+        fp = tmp;
+        at = 0;
+    }
+
+    unsigned int hash = 2166136261u;
+    int n = 0;
+    while((c = fgetc(fp)) != EOF)
+    {
+        if(c && strchr("+-<>.,[]", c))
+        {
+            hash = (hash ^ c) * 16777619u;
+            n += (c == '[');
+        }
+    }
+    fseek(fp, at, SEEK_SET);
+    return (hash == prof_hash && n == prof_nloops);
+}
+
+/*
+ * Profile format, one record per line:
+ *
+ *     bfprof <hash> <loops>
+ *     L <loop> <entries> <skips> <iterations>
+ *     P <op> <op> <count>
+ */
+int prof_load()
+{
+    FILE *pf;
+    if(prof_out && (loop_map = calloc(PROG_SIZE, sizeof(*loop_map))) == NULL)
+        return -3;
+    if(!prof_in)
+        return 0;
+    if((pf = fopen(prof_in, "r")) == NULL)
+    {
+        fprintf(stderr, "BFINTERP: %s (%s)\n", prof_in, strerror(errno));
+        return -1;
+    }
+
+    char magic[8];
+    if(fscanf(pf, "%7s %u %d", magic, &prof_hash, &prof_nloops) != 3
+        || strcmp(magic, PROF_MAGIC) || prof_nloops < 0
+        || (loops = calloc(prof_nloops + 1, sizeof(*loops))) == NULL)
+    {
+        fprintf(stderr, "Error: %s is not a profile\n", prof_in);
+        fclose(pf);
+        return -2;
+    }
+
+    char kind[2];
+    while(fscanf(pf, "%1s", kind) == 1)
+    {
+        int a, b;
+        unsigned long long x, y, z;
+        if(kind[0] == 'L' && fscanf(pf, "%d %llu %llu %llu", &a, &x, &y, &z) == 4
+            && a >= 0 && a < prof_nloops)
+        {
+            loops[a].entries = x;
+            loops[a].skips = y;
+            loops[a].iters = z;
+            loops[a].kept = 1;
+        }
+        else if(kind[0] == 'P' && fscanf(pf, "%d %d %llu", &a, &b, &x) == 3
+            && a >= 0 && a < OP_MAX && b >= 0 && b < OP_MAX)
+        {
+            pairs[a][b] = x;
+        }
+        else
+        {
+            fprintf(stderr, "Error: %s is corrupted\n", prof_in);
+            fclose(pf);
+            return -2;
+        }
+    }
+    fclose(pf);
+
+    if(!prof_match())
+    {
+        fprintf(stderr, "Warning: %s does not match this program, ignored\n", prof_in);
+        free(loops);
+        loops = NULL;
+        memset(pairs, 0, sizeof(pairs));
+    }
+    return 0;
+}
+
+int prof_save()
+{
+    FILE *pf;
+    if(!prof_out)
+        return 0;
+    if((pf = fopen(prof_out, "w")) == NULL)
+    {
+        fprintf(stderr, "BFINTERP: %s (%s)\n", prof_out, strerror(errno));
+        return -1;
+    }
+
+    fprintf(pf, PROF_MAGIC " %u %d\n", prog_hash, nloops);
+    for(int i = 0; i < bf_size; i += op_len(&prog[i]))
+    {
+        if(prog[i] == OP_JMP_FWD)
+        {
+            struct loop_prof *l = &loops[loop_map[i]];
+            fprintf(pf, "L %d %llu %llu %llu\n",
+                    loop_map[i], l->entries, l->skips, l->iters);
+        }
+    }
+    for(int a = 0; a < OP_MAX; a++)
+        for(int b = 0; b < OP_MAX; b++)
+            if(pairs[a][b])
+                fprintf(pf, "P %d %d %llu\n", a, b, pairs[a][b]);
+
+    if(fclose(pf))
+    {
+        fprintf(stderr, "BFINTERP: %s (%s)\n", prof_out, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+void kc_reset(int zero)
+{
+    kc.cur = 0;
+    kc.rest_zero = zero;
+    memset(kc.known, zero, sizeof(kc.known));
+    memset(kc.val, 0, sizeof(kc.val));
+}
+
+int kc_slot(int off)
+{
+    return (kc.cur + off) & (KNOWN_SIZE - 1);
+}
+
+/*
+ * Returns whether the cell at off is known, storing its value in *v.
+ */
+int kc_get(int off, int *v)
+{
+    *v = 0;
+    if(off < -KNOWN_SIZE / 2 || off >= KNOWN_SIZE / 2)
+        return kc.rest_zero;
+    *v = kc.val[kc_slot(off)];
+    return kc.known[kc_slot(off)];
+}
+
+void kc_set(int off, int known, int v)
+{
+    if(off < -KNOWN_SIZE / 2 || off >= KNOWN_SIZE / 2)
+    {
+        kc.rest_zero &= (known && !(v & 0xff));
+        return;
+    }
+    kc.known[kc_slot(off)] = known;
+    kc.val[kc_slot(off)] = v;
+}
+
+/*
+ * Move the window; the slot a cell leaves through is the one the cell on
+ * the other side enters by.
+ */
+void kc_move(int count)
+{
+    if(count >= KNOWN_SIZE || count <= -KNOWN_SIZE)
+    {
+        int zero = kc.rest_zero;
+        for(int s = 0; s < KNOWN_SIZE; s++)
+            zero &= (kc.known[s] && !kc.val[s]);
+        kc_reset(zero);
+        return;
+    }
+    for(; count > 0; count--)
+    {
+        int s = kc_slot(-KNOWN_SIZE / 2);
+        int zero = kc.rest_zero;
+        kc.rest_zero &= (kc.known[s] && !kc.val[s]);
+        kc.known[s] = zero;
+        kc.val[s] = 0;
+        kc.cur++;
+    }
+    for(; count < 0; count++)
+    {
+        int s = kc_slot(KNOWN_SIZE / 2 - 1);
+        int zero = kc.rest_zero;
+        kc.rest_zero &= (kc.known[s] && !kc.val[s]);
+        kc.known[s] = zero;
+        kc.val[s] = 0;
+        kc.cur--;
+    }
+}
+
+/*
+ * Cell state after the loop opened at prog[start] closed as op: a clear
+ * or a multiply loop only changes the cells it names, anything else may
+ * have touched the whole tape. The current cell is zero either way.
+ */
+void kc_loop_exit(int start, int op)
+{
+    if(sp >= KNOWN_DEPTH || (op != OP_MEM_CLR && op != OP_MUL_LOOP))
+    {
+        kc_reset(0);
+        kc_set(0, 1, 0);
+        return;
+    }
+
+    kc = kc_saved[sp];
+    int v;
+    int known = kc_get(0, &v);
+    for(int j = 0; op == OP_MUL_LOOP && j < prog[start + 1]; j++)
+    {
+        int off = prog[start + 2 + 2 * j];
+        int t;
+        if(known && kc_get(off, &t))
+            kc_set(off, 1, (t + prog[start + 3 + 2 * j] * v) & 0xff);
+        else
+            kc_set(off, 0, 0);
+    }
+    kc_set(0, 1, 0);
+}
+
+/*
+ * Skip the source of a loop that can never be entered.
+ */
+int skip_loop()
+{
+    int depth = 1;
+    while(depth)
+    {
+        switch(getop())
+        {
+            case '[':
+                depth++;
+                nloops++;
+                break;
+            case ']':
+                depth--;
+                break;
+            case EOF:
+                return -2;
+        }
+    }
+    return 0;
+}
+
 int load_bf()
 {
     int c;
     int tmp = EOF;
+    kc_reset(1);
     while(1)
     {
+        int v;
+        int op = 0;
         if(tmp != EOF)
         {
             c = tmp;
@@ -126,6 +1086,23 @@ int load_bf()
                         count--;
                 }
                 count = ((c == '+') ? count : -count);
+                if(count && kc_get(0, &v))
+                {
+                    kc_set(0, 1, v + count);
+                    if(clr_op >= 0 && clr_op == bf_size - 2 && prog[clr_op + 1] == 1)
+                    {
+                        prog[clr_op] = OP_VAL_SET;
+                        prog[clr_op + 1] = (v + count) & 0xff;
+                        clr_op = -1;
+                        count = 0;
+                    }
+                    else if(count > 1 || count < -1)
+                    {
+                        op_emitter(OP_VAL_SET);
+                        op_emitter((v + count) & 0xff);
+                        count = 0;
+                    }
+                }
                 if(count)
                 {
                     if(count == 1)
@@ -149,6 +1126,7 @@ int load_bf()
                         count--;
                 }
                 count = ((c == '>') ? count : -count);
+                kc_move(count);
                 if(count)
                 {
                     if(count == 1)
@@ -166,17 +1144,49 @@ int load_bf()
                 op_emitter(OP_PUTCHAR);
                 break;
             case ',':
+                /* a clear right before a read is dead, as in ,[.[-],] */
+                if(clr_op >= 0 && clr_op == bf_size - 2 && prog[clr_op + 1] == 1)
+                {
+                    bf_size = clr_op;
+                    clr_op = -1;
+                }
                 op_emitter(OP_GETCHAR);
+                kc_set(0, 0, 0);
                 break;
             case '[':
+                if(kc_get(0, &v) && !v)
+                {
+                    nloops++;
+                    if(skip_loop())
+                        return -2;
+                    break;
+                }
                 if(sp >= sizeof(stack)/sizeof(stack[0]))
                     return -1;
+                if(sp < KNOWN_DEPTH)
+                    kc_saved[sp] = kc;
+                kc_reset(0);
                 op_emitter(OP_JMP_FWD);
-                stack[sp++] = bf_size++;
+                op_emitter(nloops++);
+                stack[sp++] = bf_size - 1;
                 break;
             case ']':
                 if(sp <= 0)
                     return -1;
+                if(!loop_cold(prog[stack[sp - 1]])
+                    && !(op = loop_idiom(stack[sp - 1] - 1)))
+                    op = loop_lower(stack[sp - 1] - 1);
+                if(op)
+                {
+                    sp--;
+                    kc_loop_exit(stack[sp] - 1, op);
+                    break;
+                }
+                kc_reset(0);
+                kc_set(0, 1, 0);
+                io_loop(stack[sp - 1] - 1);
+                if(loop_map)
+                    loop_map[stack[sp - 1] - 1] = prog[stack[sp - 1]];
                 op_emitter(OP_JMP_BACK);
                 op_emitter(stack[--sp] - bf_size);
                 prog[(stack[sp])] = bf_size - 1;
@@ -189,14 +1199,468 @@ int load_bf()
     if(sp)
         return -2;
     prog[bf_size] = OP_STOP;
+
+    if(loops && prof_in)
+        prof_fuse();
+
+    if(prof_out)
+    {
+        free(loops);
+        if((loops = calloc(nloops + 1, sizeof(*loops))) == NULL)
+            return -3;
+        memset(pairs, 0, sizeof(pairs));
+    }
     return 0;
 }
 
-int exec_bf()
+/*
+ * Run n iterations of an OP_POLY_LOOP at once, see loop_lower().
+ */
+void poly_loop(char *data, const int *op, unsigned int pos, unsigned int n)
+{
+    int cells = op[2];
+    int size = cells * (cells + 1);
+    const int *off = &op[4];
+    const int *coef = &op[4 + cells];
+    unsigned int t1 = n - 1;
+    unsigned int t2 = (n - 1) * (n - 2) / 2;
+    unsigned char x[LOOP_MAX_CELLS + 1];
+
+    for(int j = 0; j < cells; j++)
+        x[j] = data[pos + off[j]];
+    x[cells] = 1;
+
+    for(int r = 0; r < cells; r++, coef += cells + 1)
+    {
+        unsigned int s = 0;
+        for(int c = 0; c <= cells; c++)
+            s += (coef[c] + t1 * coef[size + c] + t2 * coef[2 * size + c]) * x[c];
+        data[pos + off[r]] = s;
+    }
+}
+
+/*
+ * Number of non-zero cells from pos onwards in direction dir, i.e. the
+ * distance to the terminating zero cell.
+ */
+unsigned int run_len(const char *data, unsigned int pos, int dir)
+{
+    if(dir > 0)
+    {
+        char *p = memchr(&data[pos], 0, DATA_SIZE - pos);
+        return (p ? p - &data[pos] : DATA_SIZE - pos);
+    }
+
+    unsigned int n = 0;
+    while(n <= pos && data[pos - n])
+        n++;
+    return n;
+}
+
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+unsigned int code_hash(const int *prog, int size)
+{
+    unsigned int hash = 2166136261u;
+    for(int i = 0; i < size; i++)
+        hash = (hash ^ prog[i]) * 16777619u;
+    return hash;
+}
+
+int bfc_offset(int off)
+{
+    return (off > -DATA_SIZE && off < DATA_SIZE);
+}
+
+/*
+ * Check that mapped bytecode only holds ops the compiler could have
+ * emitted: known opcodes whose operands stay inside the program, jumps
+ * that land on the start of their partner op, and cell offsets and
+ * lengths no larger than the tape. A first pass marks where each op
+ * starts, so no jump can land inside another op's operands.
+ */
+int bfc_check()
+{
+    char *starts = calloc(bf_size + 1, 1);
+    if(starts == NULL)
+        return 0;
+    for(int i = 0; i < bf_size; i += op_len(&prog[i]))
+    {
+        const int *op = &prog[i];
+        if(op[0] <= OP_STOP || op[0] >= OP_MAX
+            || (op[0] == OP_MUL_LOOP && (op[1] < 0 || op[1] > LOOP_MAX_CELLS))
+            || (op[0] == OP_POLY_LOOP && (i + 2 >= bf_size || op[2] < 1
+                || op[2] > LOOP_MAX_CELLS || op[1] != 4 + op[2] + 3 * op[2] * (op[2] + 1)))
+            || i + op_len(op) > bf_size)
+        {
+            free(starts);
+            return 0;
+        }
+        starts[i] = 1;
+    }
+
+    for(int i = 0; i < bf_size; i += op_len(&prog[i]))
+    {
+        const int *op = &prog[i];
+        int ok = 1;
+        switch(op[0])
+        {
+            case OP_JMP_FWD:
+                ok = (op[1] > i + 1 && op[1] < bf_size && starts[op[1] - 1]
+                    && prog[op[1] - 1] == OP_JMP_BACK && op[1] - 1 + prog[op[1]] == i);
+                break;
+            case OP_JMP_BACK:
+                ok = (op[1] < 0 && i + op[1] >= 0 && starts[i + op[1]]
+                    && prog[i + op[1]] == OP_JMP_FWD && prog[i + op[1] + 1] == i + 1);
+                break;
+            case OP_MEM_CLR:
+                ok = (op[1] > 0 && op[1] < DATA_SIZE);
+                break;
+            case OP_CLR_RUN:
+            case OP_SHIFT:
+                ok = (op[1] == 1 || op[1] == -1);
+                break;
+            case OP_SCAN:
+                ok = (op[1] && bfc_offset(op[1]));
+                break;
+            case OP_MUL_LOOP:
+                for(int j = 0; ok && j < op[1]; j++)
+                    ok = bfc_offset(op[2 + 2 * j]);
+                break;
+            case OP_POLY_LOOP:
+                for(int j = 0; ok && j < op[2]; j++)
+                    ok = bfc_offset(op[4 + j]);
+                break;
+            case OP_IO_MAP:
+                ok = (i + 4 < bf_size && op[2] == OP_PUTCHAR
+                    && op[3] == OP_GETCHAR && op[4] == OP_JMP_BACK);
+                break;
+        }
+        if(!ok)
+        {
+            free(starts);
+            return 0;
+        }
+    }
+    free(starts);
+    return (prog[bf_size] == OP_STOP);
+}
+
+/*
+ * Stands in for load_bf() when the input is a .bfc file: map it and run
+ * the code in place.
+ */
+int bfc_load()
+{
+    struct stat st;
+    struct bfc_header hdr;
+    if(prof_in || prof_out)
+    {
+        fprintf(stderr, "Error: profiles need the bf source\n");
+        return -1;
+    }
+    if(fstat(fileno(fp), &st))
+    {
+        fprintf(stderr, "BFINTERP: %s\n", strerror(errno));
+        return -1;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(fp), 0);
+    if(fp != stdin)
+        fclose(fp);
+    if(map == MAP_FAILED)
+    {
+        fprintf(stderr, "mmap: %s\n", strerror(errno));
+        return -1;
+    }
+
+    memcpy(&hdr, map, sizeof(hdr));
+    if(hdr.version != BFC_VERSION || !hdr.size || hdr.size > PROG_SIZE
+        || st.st_size != sizeof(hdr) + hdr.size * sizeof(*prog))
+    {
+        fprintf(stderr, "Error: unsupported or truncated bytecode\n");
+        munmap(map, st.st_size);
+        return -2;
+    }
+
+    prog = (int *)(map + sizeof(hdr));
+    bf_size = hdr.size - 1;
+    prog_hash = hdr.prog_hash;
+    nloops = hdr.nloops;
+    if(code_hash(prog, bf_size) != hdr.checksum || !bfc_check())
+    {
+        fprintf(stderr, "Error: corrupted bytecode\n");
+        munmap(map, st.st_size);
+        prog = prog_buf;
+        bf_size = 0;
+        return -2;
+    }
+    return 0;
+}
+
+int bfc_save()
+{
+    FILE *bf;
+    if(!bfc_out)
+        return 0;
+    if((bf = fopen(bfc_out, "wb")) == NULL)
+    {
+        fprintf(stderr, "BFINTERP: %s (%s)\n", bfc_out, strerror(errno));
+        return -1;
+    }
+
+    struct bfc_header hdr = { BFC_MAGIC, BFC_VERSION, prog_hash, nloops, bf_size + 1,
+            code_hash(prog, bf_size) };
+    fwrite(&hdr, sizeof(hdr), 1, bf);
+    fwrite(prog, sizeof(*prog), bf_size + 1, bf);
+    if(fclose(bf))
+    {
+        fprintf(stderr, "BFINTERP: %s (%s)\n", bfc_out, strerror(errno));
+        return -1;
+    }
+    return FUNC_DONE;
+}
+
+void snap_request(int sig)
+{
+    (void)sig;
+    snap_signal = 1;
+}
+
+/*
+ * Write the state to a temporary file and rename it over snap_file, so a
+ * crash while saving never destroys the previous snapshot. Output made
+ * before the snapshot must have been written out already.
+ */
+int snap_save(const struct bf_ctx *ctx)
+{
+    const char *data = ctx->data;
+    const char *snap_file = ctx->snap_file;
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", snap_file);
+
+    FILE *sf = fopen(tmp, "wb");
+    if(sf == NULL)
+    {
+        fprintf(stderr, "BFINTERP: %s (%s)\n", tmp, strerror(errno));
+        return -1;
+    }
+
+    struct snap_header hdr = { SNAP_MAGIC, ctx->prog_hash, code_hash(ctx->prog, ctx->prog_size),
+            ctx->pc, ctx->pos, 0,
+            ctx->steps_used, ctx->snap_next };
+    for(unsigned int i = 0; i < DATA_SIZE; i++)
+        if(data[i] && (!i || !data[i - 1]))
+            hdr.runs++;
+    fwrite(&hdr, sizeof(hdr), 1, sf);
+
+    for(unsigned int i = 0; i < DATA_SIZE; i++)
+    {
+        if(!data[i])
+            continue;
+        unsigned int run[2] = { i, 0 };
+        while(i + run[1] < DATA_SIZE && data[i + run[1]])
+            run[1]++;
+        fwrite(run, sizeof(run), 1, sf);
+        fwrite(&data[i], 1, run[1], sf);
+        i += run[1];
+    }
+
+    if(fclose(sf) || rename(tmp, snap_file))
+    {
+        fprintf(stderr, "BFINTERP: %s (%s)\n", snap_file, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Map a snapshot taken from the same compiled program and restore the
+ * tape, pc and pos from it before exec_bf() starts.
+ */
+int snap_resume()
+{
+    if(!snap_in)
+        return 0;
+
+    int fd = open(snap_in, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st))
+    {
+        fprintf(stderr, "BFINTERP: %s (%s)\n", snap_in, strerror(errno));
+        if(fd >= 0)
+            close(fd);
+        return -1;
+    }
+    if(st.st_size < sizeof(struct snap_header))
+    {
+        fprintf(stderr, "Error: %s is not a snapshot\n", snap_in);
+        close(fd);
+        return -2;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        fprintf(stderr, "mmap: %s\n", strerror(errno));
+        return -1;
+    }
+
+    int status = 0;
+    struct snap_header hdr;
+    memcpy(&hdr, map, sizeof(hdr));
+    if(memcmp(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic)))
+    {
+        fprintf(stderr, "Error: %s is not a snapshot\n", snap_in);
+        status = -2;
+    }
+    else if(hdr.prog_hash != prog_hash || hdr.code_hash != code_hash(prog, bf_size)
+            || hdr.pc >= bf_size || hdr.pos >= DATA_SIZE)
+    {
+        fprintf(stderr, "Error: %s was taken from a different program\n", snap_in);
+        status = -3;
+    }
+
+    size_t off = sizeof(hdr);
+    for(unsigned int i = 0; !status && i < hdr.runs; i++)
+    {
+        unsigned int run[2];
+        if(st.st_size - off < sizeof(run))
+        {
+            status = -4;
+            break;
+        }
+        memcpy(run, map + off, sizeof(run));
+        off += sizeof(run);
+        if(run[0] >= DATA_SIZE || run[1] > DATA_SIZE - run[0] || st.st_size - off < run[1])
+        {
+            status = -4;
+            break;
+        }
+        memcpy(&data[run[0]], map + off, run[1]);
+        off += run[1];
+    }
+    if(status == -4)
+        fprintf(stderr, "Error: %s is corrupted\n", snap_in);
+
+    munmap(map, st.st_size);
+    start_pc = hdr.pc;
+    start_pos = hdr.pos;
+    start_steps = hdr.steps_used;
+    if(snap_steps)
+        snap_next = (hdr.snap_next > start_steps ? hdr.snap_next : start_steps + snap_steps);
+    return status;
+}
+
+/*
+ * Loop back-edges are paid for in batches so the hot path only counts
+ * down a local. Returns the next batch, or 0 with *status set when
+ * bf_run() has to yield first: BF_SNAPSHOT for a snapshot requested
+ * through snap_flag or due every snap_steps iterations, BF_LIMIT once a
+ * limit is reached.
+ */
+unsigned int step_batch(struct bf_ctx *ctx, int *status)
+{
+    int requested = (ctx->snap_flag && *ctx->snap_flag);
+    if(ctx->snap_file && (requested
+        || (ctx->snap_steps && ctx->steps_used >= ctx->snap_next)))
+    {
+        if(requested)
+            *ctx->snap_flag = 0;
+        if(ctx->snap_steps && ctx->steps_used >= ctx->snap_next)
+            ctx->snap_next += ctx->snap_steps;
+        *status = BF_SNAPSHOT;
+        return 0;
+    }
+
+    if((ctx->max_steps && ctx->steps_used >= ctx->max_steps)
+        || (ctx->deadline && now() >= ctx->deadline))
+    {
+        *status = BF_LIMIT;
+        return 0;
+    }
+
+    unsigned int n = STEP_BATCH;
+    if(ctx->max_steps && ctx->max_steps - ctx->steps_used < n)
+        n = ctx->max_steps - ctx->steps_used;
+    if(ctx->snap_file && ctx->snap_steps && ctx->snap_next - ctx->steps_used < n)
+        n = ctx->snap_next - ctx->steps_used;
+    if(!n)
+        *status = BF_LIMIT;
+    ctx->steps_used += n;
+    return n;
+}
+
+/*
+ * Bulk part of OP_IO_MAP: while *cell is non-zero, write it plus add and
+ * read the next byte into it, for as long as neither buffer runs out.
+ * Reads stop after the first zero byte, like the loop would. Every
+ * non-zero read is a taken back-edge and is paid for from *budget, which
+ * is never run down completely: the last step is left to the loop's own
+ * OP_JMP_BACK so limits and snapshots are handled there. Line flushed
+ * output is left to the single-byte ops too.
+ */
+void io_map(struct bf_ctx *ctx, char *cell, int add, unsigned int *budget)
+{
+    if(ctx->line_flush)
+        return;
+    unsigned char c = *cell;
+    size_t n = ctx->out_size - ctx->out_len;
+    if(n > ctx->in_len)
+        n = ctx->in_len;
+    if(n > *budget - 1)
+        n = *budget - 1;
+    if(c && n)
+    {
+        const unsigned char *z = memchr(ctx->in, 0, n);
+        if(z)
+            n = z - ctx->in + 1;
+        *budget -= (z ? n - 1 : n);
+
+        unsigned char *out = &ctx->out[ctx->out_len];
+        out[0] = c + add;
+        if(add)
+            for(size_t j = 1; j < n; j++)
+                out[j] = ctx->in[j - 1] + add;
+        else
+            memcpy(&out[1], ctx->in, n - 1);
+        c = ctx->in[n - 1];
+        ctx->in += n;
+        ctx->in_len -= n;
+        ctx->out_len += n;
+    }
+    if(c && !ctx->in_len && ctx->eof && ctx->out_len < ctx->out_size)
+    {
+        ctx->out[ctx->out_len++] = c + add;
+        c = 0;
+    }
+    *cell = c;
+}
+
+/*
+ * Run ctx until the program stops or has to wait for the caller. All of
+ * the run's state lives in ctx, so any number of runs can be interleaved
+ * on one thread; bf_run() picks up at ctx->pc on the next call.
+ */
+int bf_run(struct bf_ctx *ctx)
 {
-    unsigned int pos = 0;
-    for(int i = 0; prog[i]; i++)
+    const int *prog = ctx->prog;
+    char *data = ctx->data;
+    unsigned int pos = ctx->pos;
+    unsigned int budget = ctx->budget;
+    int status = BF_DONE;
+    int i = ctx->pc;
+
+    if(!budget && !(budget = step_batch(ctx, &status)))
+        return status;
+    for(; prog[i]; i++)
     {
+        if(ctx->loop_map)
+            prof_count(ctx, i, pos);
         switch(prog[i])
         {
             case OP_JMP_FWD:
@@ -207,16 +1671,42 @@ int exec_bf()
             case OP_JMP_BACK:
                 i++;
                 if(data[pos])
+                {
                     i += prog[i];
+                    if(!--budget && !(budget = step_batch(ctx, &status)))
+                    {
+                        i++;
+                        goto yield;
+                    }
+                }
                 break;
             case OP_GETCHAR:
-            {
-                int c = getchar();
-                data[pos] = ((c != EOF) ? c : 0);
+                if(ctx->in_len)
+                {
+                    data[pos] = *ctx->in++;
+                    ctx->in_len--;
+                }
+                else if(ctx->eof)
+                    data[pos] = 0;
+                else
+                {
+                    status = BF_NEED_INPUT;
+                    goto yield;
+                }
                 break;
-            }
             case OP_PUTCHAR:
-                putchar(data[pos]);
+                if(ctx->out_len == ctx->out_size)
+                {
+                    status = BF_OUTPUT;
+                    goto yield;
+                }
+                ctx->out[ctx->out_len++] = data[pos];
+                if(ctx->line_flush && data[pos] == '\n')
+                {
+                    i++;
+                    status = BF_OUTPUT;
+                    goto yield;
+                }
                 break;
             case OP_VAL_ADD:
                 i++;
@@ -238,50 +1728,298 @@ int exec_bf()
             case OP_POS_DEC:
                 pos--;
                 break;
+            case OP_MUL_LOOP:
+            {
+                char v = data[pos];
+                if(v)
+                {
+                    for(int j = 0; j < prog[i + 1]; j++)
+                        data[pos + prog[i + 2 + 2 * j]] += prog[i + 3 + 2 * j] * v;
+                    data[pos] = 0;
+                }
+                i += 1 + 2 * prog[i + 1];
+                break;
+            }
+            case OP_POLY_LOOP:
+            {
+                unsigned char n = data[pos] * prog[i + 3];
+                if(n)
+                    poly_loop(data, &prog[i], pos, n);
+                i += prog[i + 1] - 1;
+                break;
+            }
+            case OP_VAL_SET:
+                i++;
+                data[pos] = prog[i];
+                break;
+            case OP_IO_MAP:
+                i++;
+                io_map(ctx, &data[pos], prog[i], &budget);
+                if(data[pos])
+                    data[pos] += prog[i];
+                else
+                    i += 2;
+                break;
+            case OP_MOVE_ADD:
+                pos += prog[i + 1];
+                data[pos] += prog[i + 2];
+                i += 2;
+                break;
+            case OP_ADD_MOVE:
+                data[pos] += prog[i + 1];
+                pos += prog[i + 2];
+                i += 2;
+                break;
+            case OP_MEM_CLR:
+                i++;
+                memset(&data[pos], 0, prog[i]);
+                break;
+            case OP_CLR_RUN:
+            {
+                i++;
+                unsigned int n = run_len(data, pos, prog[i]);
+                if(prog[i] > 0)
+                {
+                    memset(&data[pos], 0, n);
+                    pos += n;
+                }
+                else
+                {
+                    pos -= n;
+                    memset(&data[pos + 1], 0, n);
+                }
+                break;
+            }
+            case OP_SCAN:
+                i++;
+                if(prog[i] == 1)
+                    pos += run_len(data, pos, 1);
+                else
+                    while(data[pos])
+                        pos += prog[i];
+                break;
+            case OP_SHIFT:
+            {
+                i++;
+                unsigned int n = run_len(data, pos, prog[i]);
+                if(!n)
+                    break;
+                if(prog[i] > 0)
+                {
+                    data[pos - 1] += data[pos];
+                    memmove(&data[pos], &data[pos + 1], n - 1);
+                    data[pos + n - 1] = 0;
+                    pos += n;
+                }
+                else
+                {
+                    data[pos + 1] += data[pos];
+                    pos -= n;
+                    memmove(&data[pos + 2], &data[pos + 1], n - 1);
+                    data[pos + 1] = 0;
+                }
+                break;
+            }
             default:
                 fprintf(stderr, "Unknown op[0x%08x] at: %d\n", prog[i], i);
-                return i;
+                status = BF_BAD_OP;
+                goto yield;
         }
     }
 
+yield:
+    ctx->pc = i;
+    ctx->pos = pos;
+    ctx->budget = budget;
+    return status;
+}
+
+int write_all(int fd, const unsigned char *buf, size_t len)
+{
+    while(len)
+    {
+        ssize_t n = write(fd, buf, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+        {
+            fprintf(stderr, "BFINTERP: write (%s)\n", strerror(errno));
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
     return 0;
 }
 
+/*
+ * Drive bf_run() from stdin and stdout. Pending output is written every
+ * time the program yields, so a prompt shows up before we block on input.
+ * Output is flushed every OUT_FLUSH_SIZE bytes like stdio would, or per
+ * line on a terminal, except while input is buffered: a filter then gets
+ * the whole buffer.
+ */
+int exec_bf()
+{
+    unsigned char in[IO_BUF_SIZE];
+    unsigned char out[IO_BUF_SIZE];
+    struct bf_ctx ctx = {
+        .prog = prog,
+        .prog_size = bf_size,
+        .prog_hash = prog_hash,
+        .loop_map = loop_map,
+        .pc = start_pc,
+        .pos = start_pos,
+        .data = data,
+        .out = out,
+        .line_flush = isatty(STDOUT_FILENO),
+        .max_steps = max_steps,
+        .steps_used = start_steps,
+        .deadline = deadline,
+        .snap_file = snap_file,
+        .snap_steps = snap_steps,
+        .snap_next = snap_next,
+        .snap_flag = &snap_signal,
+    };
+
+    for(;;)
+    {
+        ctx.out_size = (ctx.in_len ? sizeof(out) : OUT_FLUSH_SIZE);
+        int status = bf_run(&ctx);
+        if(write_all(STDOUT_FILENO, out, ctx.out_len))
+            return -1;
+        ctx.out_len = 0;
+
+        if(status == BF_NEED_INPUT)
+        {
+            ssize_t n = read(STDIN_FILENO, in, sizeof(in));
+            if(n < 0 && errno == EINTR)
+                continue;
+            ctx.in = in;
+            ctx.in_len = (n > 0 ? n : 0);
+            ctx.eof = (n <= 0);
+        }
+        else if(status == BF_SNAPSHOT)
+            snap_save(&ctx);
+        else if(status == BF_LIMIT)
+        {
+            if(ctx.max_steps && ctx.steps_used >= ctx.max_steps)
+                fprintf(stderr, "BFINTERP: step limit of %llu reached\n", ctx.max_steps);
+            else
+                fprintf(stderr, "BFINTERP: time limit of %ss reached\n", opt_timeout);
+            return LIMIT_STATUS;
+        }
+        else if(status == BF_BAD_OP)
+            return ctx.pc;
+        else if(status == BF_DONE)
+            return 0;
+    }
+}
+
 void help(const char *name)
 {
     fprintf(stderr, ABOUT);
-    fprintf(stderr, "Usage: %s bf-file\n", name);
+    fprintf(stderr, "Usage: %s [options] bf-file\n", name);
+    fprintf(stderr, "  --profile-out file   record loop and op pair counts to file\n");
+    fprintf(stderr, "  --profile-in file    optimize using a recorded profile\n");
+    fprintf(stderr, "  --max-steps n        stop after n loop iterations\n");
+    fprintf(stderr, "  --timeout seconds    stop after the given wall-clock time\n");
+    fprintf(stderr, "  --compile bf-file    compile to bytecode instead of running\n");
+    fprintf(stderr, "  -o file              bytecode output, run it as: %s file\n", name);
+    fprintf(stderr, "  --snapshot file      save the state to file on SIGUSR1\n");
+    fprintf(stderr, "  --snapshot-steps n   also save it every n loop iterations\n");
+    fprintf(stderr, "  --resume file        continue from a saved state\n");
+    fprintf(stderr, "A program stopped by a limit exits with status %d.\n", LIMIT_STATUS);
     exit(-1);
 }
 
 int main(int argc, const char * argv[])
 {
-    if(argc == 1)
+    static const struct
+    {
+        const char *name;
+        const char **value;
+    } options[] = {
+        { "--profile-out", &prof_out },
+        { "--profile-in",  &prof_in },
+        { "--max-steps",   &opt_max_steps },
+        { "--timeout",     &opt_timeout },
+        { "--snapshot",    &snap_file },
+        { "--snapshot-steps", &opt_snap_steps },
+        { "--resume",      &snap_in },
+        { "--compile",     &bfc_src },
+        { "-o",            &bfc_out },
+    };
+
+    int arg = 1;
+    while(arg < argc && argv[arg][0] == '-')
+    {
+        int i = 0;
+        while(i < sizeof(options)/sizeof(options[0]) && strcmp(argv[arg], options[i].name))
+            i++;
+        if(i == sizeof(options)/sizeof(options[0]) || arg + 1 >= argc)
+            help(argv[0]);
+        *options[i].value = argv[arg + 1];
+        arg += 2;
+    }
+
+    if(opt_max_steps)
+        max_steps = strtoull(opt_max_steps, NULL, 10);
+    if(opt_timeout && strtod(opt_timeout, NULL) > 0)
+        deadline = now() + strtod(opt_timeout, NULL);
+    if(opt_snap_steps)
+        snap_next = snap_steps = strtoull(opt_snap_steps, NULL, 10);
+    if(snap_file)
+        signal(SIGUSR1, snap_request);
+
+    const char *path = (bfc_src ? bfc_src : argv[arg]);
+    if(!bfc_src != !bfc_out || (bfc_src && arg != argc) || (opt_snap_steps && !snap_file))
+        help(argv[0]);
+    else if(arg == argc && !bfc_src)
     {
         if(isatty(STDIN_FILENO))
             help(argv[0]);
         fp = stdin;
     }
-    else if(argc != 2)
+    else if(arg + 1 != argc && !bfc_src)
         help(argv[0]);
-    else if((fp = fopen(argv[1], "r")) == NULL)
+    else if((fp = fopen(path, "r")) == NULL)
     {
-    	fprintf(stderr, "BFINTERP: %s (%s)\n", argv[1], strerror(errno));
+    	fprintf(stderr, "BFINTERP: %s (%s)\n", path, strerror(errno));
     	return -1;
     }
 
-    if(fgetc(fp) == '#' && fgetc(fp) =='!')
+    /* Only a seekable file can be probed for bytecode and rewound. */
+    char magic[sizeof(BFC_MAGIC) - 1];
+    int bytecode = (ftell(fp) >= 0
+            && fread(magic, 1, sizeof(magic), fp) == sizeof(magic)
+            && !memcmp(magic, BFC_MAGIC, sizeof(magic)));
+    if(ftell(fp) >= 0)
+        rewind(fp);
+
+    int c = fgetc(fp);
+    if(bytecode)
     {
-        int i;
-        do {
-            i = fgetc(fp);
-        } while(i != '\n' && i != EOF);
-    } else
         rewind(fp);
+        for(int i = 0; i < sizeof(bf_func)/sizeof(bf_func[0]); i++)
+            if(bf_func[i] == load_bf)
+                bf_func[i] = bfc_load;
+    }
+    else if(c == '#' && (c = fgetc(fp)) == '!')
+    {
+        do {
+            c = fgetc(fp);
+        } while(c != '\n' && c != EOF);
+    } else if(c != EOF)
+        ungetc(c, fp);
 
     for(int i = 0; i < sizeof(bf_func)/sizeof(bf_func[0]); i++)
     {
         int status = bf_func[i]();
+        if(status == LIMIT_STATUS && bf_func[i] == exec_bf)
+            return status;
+        if(status == FUNC_DONE)
+            return 0;
         if(status)
         {
             fprintf(stderr, "Error: bf_func[%d] returned %d\n", i, status);
@@ -28,9 +28,11 @@
 
 #include <stdio.h>          // putchar, getchar, fprintf, fopen, fgetc, fclose, rewind
 #include <stdlib.h>         // exit
+#include <string.h>         // memset, memmove, memchr, memcmp
 #include <errno.h>          // strerror, errno
 #include <unistd.h>         // isatty
 #include <sys/mman.h>       // mmap, munmap
+#include <time.h>           // clock_gettime
 
 // scratch registers
 #define x0      0
@@ -50,6 +52,9 @@
 #define w5      x5
 #define w6      x6
 #define w7      x7
+// callee-saved, holds the loop back-edge budget
+#define x19     19
+#define w19     x19
 // xZR regs is 31
 #define xZR     31
 #define wZR     xZR
@@ -70,10 +75,17 @@
 
 #define LD_gen(size, op1, imm12, Rn, Rt)        ((size)<<30 | 0b111<<27 | (op1)<<24 | 0b01<<22 | (imm12)<<10 | (Rn)<<5 | (Rt))
 #define LDRB_U12(Rt, Rn, imm12)           EMIT(LD_gen(0b00, 0b01, ((uint32_t)((imm12)))&0xfff, Rn, Rt))
+#define LDRw_U12(Rt, Rn, imm12)           EMIT(LD_gen(0b10, 0b01, ((uint32_t)((imm12)>>2))&0xfff, Rn, Rt))
 
 #define ST_gen(size, op1, imm12, Rn, Rt)        ((size)<<30 | 0b111<<27 | (op1)<<24 | 0b00<<22 | (imm12)<<10 | (Rn)<<5 | (Rt))
 #define STRB_U12(Rt, Rn, imm12)           EMIT(ST_gen(0b00, 0b01, ((uint32_t)((imm12)))&0xfff, Rn, Rt))
 
+#define MOVW_gen(sf, opc, hw, imm16, Rd)  ((sf)<<31 | (opc)<<29 | 0b100101<<23 | (hw)<<21 | (imm16)<<5 | (Rd))
+#define MOVZx(Rd, imm16, hw)            EMIT(MOVW_gen(1, 0b10, hw, (imm16)&0xffff, Rd))
+#define MOVKx(Rd, imm16, hw)            EMIT(MOVW_gen(1, 0b11, hw, (imm16)&0xffff, Rd))
+#define MOVZw(Rd, imm16)                EMIT(MOVW_gen(0, 0b10, 0, (imm16)&0xffff, Rd))
+#define MOVNw(Rd, imm16)                EMIT(MOVW_gen(0, 0b00, 0, (imm16)&0xffff, Rd))
+
 #define BR_gen(Z, op, A, M, Rn, Rm)       (0b1101011<<25 | (Z)<<24 | (op)<<21 | 0b11111<<16 | (A)<<11 | (M)<<10 | (Rn)<<5 | (Rm))
 #define BLR(Rn)                           EMIT(BR_gen(0, 0b01, 0, 0, Rn, 0))
 
@@ -82,6 +94,7 @@
 
 #define CB_gen(sf, op, imm19, Rt)       ((sf)<<31 | 0b011010<<25 | (op)<<24 | (imm19)<<5 | (Rt))
 #define CBZw(Rt, imm19)                 CB_gen(0, 0, ((imm19)>>2)&0x7FFFF, Rt)
+#define CBNZw(Rt, imm19)                CB_gen(0, 1, ((imm19)>>2)&0x7FFFF, Rt)
 
 #define INSTR_SIZE 4
 #define JMP(x) EMIT(B((x) * INSTR_SIZE))
@@ -95,6 +108,9 @@
 
 #define DATA_SIZE 65535
 #define PROG_SIZE 1024*1024
+#define HIST_SIZE 16
+#define STEP_BATCH 0xffff
+#define LIMIT_STATUS 124
 
 int bf_load();
 int bf_exec();
@@ -108,13 +124,24 @@ FILE *fp = NULL;
 char data[DATA_SIZE] = {};
 int *prog = NULL;
 int stack[PROG_SIZE/2] = {};
+char hist[HIST_SIZE] = {};
+unsigned int hist_len = 0;
+unsigned int hist_stack[PROG_SIZE/2] = {};
+const char *opt_max_steps = NULL;
+const char *opt_timeout = NULL;
+unsigned long long max_steps = 0;
+unsigned long long steps_used = 0;
+unsigned int budget = 0;
+double deadline = 0;
 int (*bf_func[])() = { bf_load, bf_exec, bf_unmap };
 
 static const unsigned int inst[] = {
     0xa9bf7bfd,        // stp x29, x30, [sp, #-16]!
     0x910003fd,        // mov x29, sp
     0xa8c17bfd,        // ldp x29, x30, [sp], #16
-    0xd65f03c0         // ret
+    0xd65f03c0,        // ret
+    0xa9bf53f3,        // stp x19, x20, [sp, #-16]!
+    0xa8c153f3         // ldp x19, x20, [sp], #16
 };
 
 static inline size_t align(size_t size) {
@@ -154,6 +181,33 @@ static inline void arm64_subx(int reg, unsigned int count)
     return;
 }
 
+static inline void arm64_call(void *func, int dir)
+{
+    unsigned long addr = (unsigned long)func;
+    if(dir < 0)
+        MOVNw(w0, 0);
+    else
+        MOVZw(w0, dir);
+    MOVZx(x4, addr, 0);
+    for(int hw = 1; hw < 4; hw++)
+        MOVKx(x4, addr >> (16 * hw), hw);
+    BLR(x4);
+    return;
+}
+
+/*
+ * Reload w19 from budget after bf_budget() has refilled it.
+ */
+static inline void arm64_load_budget()
+{
+    unsigned long addr = (unsigned long)&budget;
+    MOVZx(x4, addr, 0);
+    for(int hw = 1; hw < 4; hw++)
+        MOVKx(x4, addr >> (16 * hw), hw);
+    LDRw_U12(w19, x4, 0);
+    return;
+}
+
 void reg_rec(int, void*, void*, void*);
 asm(
     ".text\n\t"
@@ -197,12 +251,216 @@ int getop()
             case ',':
             case '[':
             case ']':
+                hist[hist_len++ % HIST_SIZE] = c;
+                return c;
             case EOF:
                 return c;
         }
     }
 }
 
+/*
+ * Number of non-zero cells from d onwards in direction dir, i.e. the
+ * distance to the terminating zero cell.
+ */
+static size_t run_len(char *d, int dir)
+{
+    if(dir > 0)
+    {
+        char *p = memchr(d, 0, data + DATA_SIZE - d);
+        return (p ? p - d : data + DATA_SIZE - d);
+    }
+
+    size_t n = 0;
+    while(n <= d - data && *(d - n))
+        n++;
+    return n;
+}
+
+void bf_scan(int dir, char *d, void *put_func, void *get_func)
+{
+    if(dir > 0)
+        d += run_len(d, dir);
+    else
+        d -= run_len(d, dir);
+    reg_rec(dir, d, put_func, get_func);
+    return;
+}
+
+void bf_clr_run(int dir, char *d, void *put_func, void *get_func)
+{
+    size_t n = run_len(d, dir);
+    if(dir > 0)
+    {
+        memset(d, 0, n);
+        d += n;
+    }
+    else
+    {
+        d -= n;
+        memset(d + 1, 0, n);
+    }
+    reg_rec(dir, d, put_func, get_func);
+    return;
+}
+
+void bf_shift(int dir, char *d, void *put_func, void *get_func)
+{
+    size_t n = run_len(d, dir);
+    if(n && dir > 0)
+    {
+        d[-1] += d[0];
+        memmove(d, d + 1, n - 1);
+        d[n - 1] = 0;
+        d += n;
+    }
+    else if(n)
+    {
+        d[1] += d[0];
+        d -= n;
+        memmove(d + 2, d + 1, n - 1);
+        d[1] = 0;
+    }
+    reg_rec(dir, d, put_func, get_func);
+    return;
+}
+
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Hand out the next batch of loop back-edges, never more than is left of
+ * max_steps. steps_used counts batches as they are handed out.
+ */
+unsigned int step_batch()
+{
+    unsigned int n = STEP_BATCH;
+    if(max_steps && max_steps - steps_used < n)
+        n = max_steps - steps_used;
+    steps_used += n;
+    return n;
+}
+
+/*
+ * Check the limits once a batch of loop back-edges is used up and hand out
+ * the next one. Exits with partial output flushed once a limit is hit.
+ */
+unsigned int budget_refill()
+{
+    if(max_steps && steps_used >= max_steps)
+    {
+        fflush(stdout);
+        fprintf(stderr, "BFINTERP: step limit of %llu reached\n", max_steps);
+        exit(LIMIT_STATUS);
+    }
+    if(deadline && now() >= deadline)
+    {
+        fflush(stdout);
+        fprintf(stderr, "BFINTERP: time limit of %ss reached\n", opt_timeout);
+        exit(LIMIT_STATUS);
+    }
+    return step_batch();
+}
+
+/*
+ * Called by the generated code each time w19 has counted down a batch of
+ * loop back-edges, which reloads it from budget on return.
+ */
+void bf_budget(char a, char *d, void *put_func, void *get_func)
+{
+    budget = budget_refill();
+    reg_rec(a, d, put_func, get_func);
+    return;
+}
+
+/*
+ * Copy-through and map-through I/O loops, [.,] [.[-],] [+++.,]: echo
+ * each input byte plus add until a zero byte or EOF is read. With limits
+ * on, the generated code passes w19 in w5 (x4 holds our address) and
+ * reloads it from budget afterwards; every iteration is paid for from it
+ * like the loop's own ']' would be.
+ */
+void bf_io_map(int add, char *d, void *put_func, void *get_func,
+               void *func, unsigned int left)
+{
+    int limited = (max_steps || deadline);
+    while(*d)
+    {
+        putchar_unlocked(*d + add);
+        int ch = getchar_unlocked();
+        *d = ((ch != EOF) ? ch : 0);
+        if(limited && !--left)
+            left = budget_refill();
+    }
+    budget = left;
+    reg_rec(add, d, put_func, get_func);
+    return;
+}
+
+/*
+ * Lower the loop just closed by ']' if its body is one of the bulk memory
+ * or I/O idioms, replacing the code emitted since its '['.
+ */
+int loop_idiom(int start, unsigned int open)
+{
+    static const struct {
+        const char *body;
+        void *func;
+        int dir;
+    } idioms[] = {
+        { ">",          bf_scan,     1 },
+        { "<",          bf_scan,    -1 },
+        { "[-]>",       bf_clr_run,  1 },
+        { "[-]<",       bf_clr_run, -1 },
+        { "[-<+>]>",    bf_shift,    1 },
+        { "[->+<]<",    bf_shift,   -1 },
+    };
+
+    unsigned int len = hist_len - open - 2;
+    if(len >= HIST_SIZE - 2)
+        return 0;
+
+    char body[HIST_SIZE];
+    for(unsigned int i = 0; i < len; i++)
+        body[i] = hist[(open + 1 + i) % HIST_SIZE];
+    body[len] = '\0';
+
+    if(!strcmp(body, "-") || !strcmp(body, "+"))
+    {
+        bf_size = start;
+        STRB_U12(wZR, x1, 0);
+        return 1;
+    }
+    size_t adds = strspn(body, "+-");
+    if(!strcmp(body + adds, ".,") || !strcmp(body + adds, ".[-],"))
+    {
+        int add = 0;
+        for(size_t i = 0; i < adds; i++)
+            add += ((body[i] == '+') ? 1 : -1);
+        bf_size = start;
+        if(max_steps || deadline)
+            MOVw_REG(w5, w19);
+        arm64_call(bf_io_map, add & 0xff);
+        if(max_steps || deadline)
+            arm64_load_budget();
+        return 1;
+    }
+    for(int i = 0; i < sizeof(idioms)/sizeof(idioms[0]); i++)
+    {
+        if(!strcmp(body, idioms[i].body))
+        {
+            bf_size = start;
+            arm64_call(idioms[i].func, idioms[i].dir);
+            return 1;
+        }
+    }
+    return 0;
+}
+
 void bf_putchar(char a, char *d, void *put_func, void *get_func)
 {
 #ifdef DEBUG
@@ -234,6 +492,11 @@ int bf_load()
 
     for(int i = 0; i < 2; i++, bf_size++)
         prog[i] = inst[i];
+    if(max_steps || deadline)
+    {
+        EMIT(inst[4]);
+        MOVZw(w19, step_batch());
+    }
 
     int c;
     int tmp = EOF;
@@ -303,6 +566,7 @@ int bf_load()
                     return -1;
                 }
                 LDRB_U12(w0, x1, 0);
+                hist_stack[sp] = hist_len - 1;
                 stack[sp++] = bf_size;
                 EMIT(0);
                 break;
@@ -313,6 +577,15 @@ int bf_load()
                     bf_unmap();
                     return -1;
                 }
+                if(loop_idiom(stack[sp] - 1, hist_stack[sp]))
+                    break;
+                if(max_steps || deadline)
+                {
+                    SUBw_U12(w19, w19, 1);
+                    EMIT(CBNZw(w19, 12 * INSTR_SIZE));
+                    arm64_call(bf_budget, 0);
+                    arm64_load_budget();
+                }
                 JMP_IF(bf_size - stack[sp] + 1);
                 JMP(stack[sp] - bf_size - 1);
                 break;
@@ -325,6 +598,8 @@ int bf_load()
     {
         return -2;
     }
+    if(max_steps || deadline)
+        prog[bf_size++] = inst[5];
     for(int i = 2; i < 4; i++)
         prog[bf_size++] = inst[i];
 
@@ -367,23 +642,52 @@ int bf_unmap()
 void help(const char *name)
 {
     fprintf(stderr, ABOUT);
-    fprintf(stderr, "Usage: %s bf-file\n", name);
+    fprintf(stderr, "Usage: %s [options] bf-file\n", name);
+    fprintf(stderr, "  --max-steps n        stop after about n loop iterations\n");
+    fprintf(stderr, "  --timeout seconds    stop after the given wall-clock time\n");
+    fprintf(stderr, "A program stopped by a limit exits with status %d.\n", LIMIT_STATUS);
     exit(-1);
 }
 
 int main(int argc, const char * argv[])
 {
-    if(argc == 1)
+    static const struct
+    {
+        const char *name;
+        const char **value;
+    } options[] = {
+        { "--max-steps",   &opt_max_steps },
+        { "--timeout",     &opt_timeout },
+    };
+
+    int arg = 1;
+    while(arg < argc && argv[arg][0] == '-' && argv[arg][1] == '-')
+    {
+        int i = 0;
+        while(i < sizeof(options)/sizeof(options[0]) && strcmp(argv[arg], options[i].name))
+            i++;
+        if(i == sizeof(options)/sizeof(options[0]) || arg + 1 >= argc)
+            help(argv[0]);
+        *options[i].value = argv[arg + 1];
+        arg += 2;
+    }
+
+    if(opt_max_steps)
+        max_steps = strtoull(opt_max_steps, NULL, 10);
+    if(opt_timeout && strtod(opt_timeout, NULL) > 0)
+        deadline = now() + strtod(opt_timeout, NULL);
+
+    if(arg == argc)
     {
         if(isatty(STDIN_FILENO))
             help(argv[0]);
         fp = stdin;
     }
-    else if(argc != 2)
+    else if(arg + 1 != argc)
         help(argv[0]);
-    else if((fp = fopen(argv[1], "r")) == NULL)
+    else if((fp = fopen(argv[arg], "r")) == NULL)
     {
-    	fprintf(stderr, "BFINTERP: %s (%s)\n", argv[1], strerror(errno));
+    	fprintf(stderr, "BFINTERP: %s (%s)\n", argv[arg], strerror(errno));
     	return -1;
     }
 